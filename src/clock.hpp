@@ -0,0 +1,22 @@
+/*
+ *
+ * This file is part of trackpad-is-too-damn-big utility
+ * Copyright (c) https://github.com/tascvh/trackpad-is-too-damn-big
+ *
+ */
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+
+constexpr int64_t ns_per_sec = 1'000'000'000;
+
+constexpr int64_t toNs(const timespec &ts) noexcept {
+  return int64_t(ts.tv_sec) * ns_per_sec + ts.tv_nsec;
+}
+
+inline int64_t clockNs(clockid_t clock) noexcept {
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return toNs(ts);
+}
@@ -6,26 +6,43 @@
  */
 #include "libevdev/libevdev-uinput.h"
 #include "libevdev/libevdev.h"
+#include <atomic>
 #include <cerrno>
+#include <csignal>
 #include <cstring>
 #include <exception>
 #include <fcntl.h>
 #include <format>
 #include <iostream>
+#include <poll.h>
+#include <pthread.h>
 #include <unistd.h>
 
 extern "C" void print_evdev(struct libevdev *dev);
 
+// Set from signal handlers, event handlers or the load generator thread,
+// the running event loop returns once the current frame has been handled.
+inline std::atomic<bool> stop_requested = false;
+static_assert(std::atomic<bool>::is_always_lock_free,
+              "stop_requested is set from signal handlers");
+inline void requestStop() noexcept { stop_requested = true; }
+
+// Set along with stop_requested when another process asks to take over the
+// device, the event loop then leaves the device grabbed.
+inline std::atomic<bool> handoff_requested = false;
+
 class Evdev final {
   int m_fd = 0;
   struct libevdev *m_dev = nullptr;
+  bool m_grabbed = false;
 
 public:
   Evdev(const Evdev &) = delete;
   Evdev &operator=(const Evdev &) = delete;
   Evdev &operator=(Evdev &&) = delete;
 
-  Evdev(Evdev &&other) noexcept : m_fd(other.m_fd), m_dev(other.m_dev) {
+  Evdev(Evdev &&other) noexcept
+      : m_fd(other.m_fd), m_dev(other.m_dev), m_grabbed(other.m_grabbed) {
     other.m_dev = nullptr;
     other.m_fd = 0;
   }
@@ -44,6 +61,16 @@ public:
     }
   }
 
+  // Takes ownership of a device fd handed over by another process, which
+  // is still grabbed by it. The grab is released when the fd is closed.
+  explicit Evdev(int fd) : m_fd(fd), m_grabbed(true) {
+    int rc = libevdev_new_from_fd(m_fd, &m_dev);
+    if (rc < 0) {
+      close(m_fd);
+      throw std::runtime_error("Failed to init libevdev \n");
+    }
+  }
+
   ~Evdev() {
     if (m_dev)
       libevdev_free(m_dev);
@@ -55,26 +82,51 @@ public:
     return T(m_dev, args...);
   }
 
+  int fd() const { return m_fd; }
+
   void grab(bool grab) {
+    if (grab == m_grabbed)
+      return;
     int rc = libevdev_grab(m_dev, grab ? LIBEVDEV_GRAB : LIBEVDEV_UNGRAB);
     if (0 != rc) {
       std::string s = std::format("Failed to {}grab device", grab ? "" : "un");
       throw std::runtime_error(s);
     }
+    m_grabbed = grab;
   }
 
   void print() { print_evdev(m_dev); }
 
-  template <typename EventHandler> auto runEventLoop(EventHandler handler) {
+  template <typename EventHandler> auto runEventLoop(EventHandler &&handler) {
 
     if (handler.grab())
       grab(true);
 
+    // signals are only delivered while waiting in ppoll, so a stop cannot
+    // slip in between checking for it and blocking
+    sigset_t all, waiting;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &waiting);
+
     int rc = 0;
-    do {
+    while (true) {
+      rc = libevdev_has_event_pending(m_dev);
+      if (rc < 0)
+        break;
+      if (rc == 0) {
+        // once stopping, leave on this frame boundary
+        if (stop_requested)
+          break;
+        pollfd pfd = {m_fd, POLLIN, 0};
+        if (ppoll(&pfd, 1, nullptr, &waiting) < 0 && errno != EINTR) {
+          rc = -errno;
+          break;
+        }
+        continue;
+      }
+
       input_event ev;
-      rc = libevdev_next_event(
-          m_dev, LIBEVDEV_READ_FLAG_NORMAL | LIBEVDEV_READ_FLAG_BLOCKING, &ev);
+      rc = libevdev_next_event(m_dev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
       if (rc == LIBEVDEV_READ_STATUS_SYNC) {
         while (rc == LIBEVDEV_READ_STATUS_SYNC) {
           handler.eventSync(ev);
@@ -86,15 +138,18 @@ public:
         } else {
           handler.eventData(ev);
         }
+      } else if (rc != -EAGAIN) {
+        break;
       }
-    } while (rc == LIBEVDEV_READ_STATUS_SYNC ||
-             rc == LIBEVDEV_READ_STATUS_SUCCESS || rc == -EAGAIN);
+    }
 
-    if (rc != LIBEVDEV_READ_STATUS_SUCCESS && rc != -EAGAIN) {
+    pthread_sigmask(SIG_SETMASK, &waiting, nullptr);
+
+    if (rc < 0) {
       std::cerr << "Failed to handle events: " << strerror(-rc) << std::endl;
     }
 
-    if (handler.grab())
+    if (handler.grab() && !handoff_requested)
       grab(false);
 
     return rc;
@@ -130,6 +185,9 @@ public:
     sleep(1);
   }
 
+  // Takes ownership of the fd of a uinput device created by another process.
+  explicit UInput(int fd) : m_fd(fd) {}
+
   ~UInput() {
     if (m_uinput)
       libevdev_uinput_destroy(m_uinput);
@@ -137,8 +195,34 @@ public:
       close(m_fd);
   }
 
+  int fd() const { return m_fd; }
+
+  // Keeps the device alive for the process it was handed over to. libevdev
+  // cannot free its handle without destroying the device, so it is leaked.
+  void release() { m_uinput = nullptr; }
+
+  std::string devnode() const {
+    const char *node =
+        m_uinput ? libevdev_uinput_get_devnode(m_uinput) : nullptr;
+    if (!node) {
+      throw std::runtime_error("Failed to get uinput device node");
+    }
+    return node;
+  }
+
   int writeEvent(const input_event &ev) {
-    int rc = libevdev_uinput_write_event(m_uinput, ev.type, ev.code, ev.value);
+    int rc = 0;
+    if (m_uinput) {
+      rc = libevdev_uinput_write_event(m_uinput, ev.type, ev.code, ev.value);
+    } else {
+      // adopted device, write like libevdev does and let the kernel stamp it
+      input_event out{};
+      out.type = ev.type;
+      out.code = ev.code;
+      out.value = ev.value;
+      if (write(m_fd, &out, sizeof(out)) != sizeof(out))
+        rc = -errno;
+    }
     if (rc != 0)
       std::cerr << "Failed to write event";
     return rc;
@@ -4,6 +4,8 @@
  * Copyright (c) https://github.com/tascvh/trackpad-is-too-damn-big
  *
  */
+#include <algorithm>
+#include <cstdint>
 #include <exception>
 #include <unordered_set>
 #include <vector>
@@ -13,6 +15,10 @@
 class PassAll {
 public:
   constexpr void processEvents(std::vector<input_event> &) {}
+  void saveState(std::vector<int32_t> &) const {}
+  void loadState(const std::vector<int32_t> &) {}
+  constexpr void release() noexcept {}
+  constexpr bool suppressed(int) const noexcept { return false; }
 };
 
 class CropRect {
@@ -38,6 +44,11 @@ protected:
   };
   std::vector<Point> m_slot_coordinates;
 
+  // Slot state is exchanged as a flat list of int32 :
+  // current slot, number of slots, then x, y, active, valid for each slot
+  static constexpr size_t state_header = 2;
+  static constexpr size_t state_fields = 4;
+
 public:
   CropRect(libevdev const *const dev, int perc_left, int perc_right,
            int perc_top, int perc_bottom) {
@@ -54,7 +65,7 @@ public:
       throw std::runtime_error("Failed to get slot info");
     }
     m_num_slot_max = ai->maximum;
-    m_slot_coordinates.reserve(m_num_slot_max);
+    m_slot_coordinates.resize(m_num_slot_max + 1);
 
     ai = libevdev_get_abs_info(dev, ABS_X);
     if (!ai) {
@@ -85,7 +96,31 @@ public:
     m_top -= perc_top * range_y / 100;
   }
 
-  constexpr bool insideValidArea(int x, int y) noexcept {
+  void saveState(std::vector<int32_t> &state) const {
+    state.clear();
+    state.push_back(m_current_slot);
+    state.push_back(static_cast<int32_t>(m_slot_coordinates.size()));
+    for (const auto &p : m_slot_coordinates) {
+      state.insert(state.end(), {p.x, p.y, 0, 0});
+    }
+  }
+
+  void loadState(const std::vector<int32_t> &state) {
+    if (state.size() < state_header || state[1] < 0 ||
+        state.size() != state_header + state[1] * state_fields ||
+        state[0] < 0 ||
+        state[0] >= static_cast<int32_t>(m_slot_coordinates.size())) {
+      throw std::runtime_error("Invalid filter state");
+    }
+    auto slots = std::min<size_t>(state[1], m_slot_coordinates.size());
+    m_current_slot = state[0];
+    for (size_t s = 0; s < slots; ++s) {
+      m_slot_coordinates[s].x = state[state_header + s * state_fields];
+      m_slot_coordinates[s].y = state[state_header + s * state_fields + 1];
+    }
+  }
+
+  constexpr bool insideValidArea(int x, int y) const noexcept {
     y = -y; // y axis is flipped
     if (x >= m_left && x <= m_right && y >= m_bottom && y <= m_top) {
       return true;
@@ -93,6 +128,15 @@ public:
     return false;
   }
 
+  // the saved state was handed over, nothing else is owned
+  constexpr void release() noexcept {}
+
+  // whether the contact in the slot has its size zeroed
+  constexpr bool suppressed(int slot) const noexcept {
+    return !insideValidArea(m_slot_coordinates[slot].x,
+                            m_slot_coordinates[slot].y);
+  }
+
   constexpr void
   processEvents(std::vector<input_event> &event_buffer) noexcept {
     int slot = m_current_slot;
@@ -145,9 +189,33 @@ public:
     auto delta_y = m_dev_top - m_dev_bottom;
     m_diagonal_sq = delta_x * delta_x + delta_y * delta_y;
     m_set_slots.reserve(m_num_slot_max);
-    m_slot_valid.reserve(m_num_slot_max);
+    m_slot_valid.resize(m_num_slot_max + 1);
   }
 
+  void saveState(std::vector<int32_t> &state) const {
+    CropRect::saveState(state);
+    for (size_t s = 0; s < m_slot_valid.size(); ++s) {
+      auto fields = state.begin() + state_header + s * state_fields;
+      fields[2] = m_set_slots.contains(static_cast<int>(s));
+      fields[3] = m_slot_valid[s];
+    }
+  }
+
+  void loadState(const std::vector<int32_t> &state) {
+    CropRect::loadState(state);
+    auto slots = std::min<size_t>(state[1], m_slot_valid.size());
+    m_set_slots.clear();
+    for (size_t s = 0; s < slots; ++s) {
+      if (state[state_header + s * state_fields + 2])
+        m_set_slots.insert(static_cast<int>(s));
+      m_slot_valid[s] = state[state_header + s * state_fields + 3];
+    }
+  }
+
+  using CropRect::release;
+
+  bool suppressed(int slot) const noexcept { return !m_slot_valid[slot]; }
+
   void processEvents(std::vector<input_event> &event_buffer) noexcept {
     // we will save the last reported slot
     // before processing the events
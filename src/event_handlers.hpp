@@ -5,6 +5,7 @@
  *
  */
 #include "libevdev/libevdev.h"
+#include "profiling.hpp"
 #include <vector>
 
 extern "C" int print_event(const struct input_event *const ev);
@@ -17,27 +18,37 @@ public:
   void eventSync(const input_event &ev) { print_event(&ev); }
 };
 
-template <typename Destination, typename Filter> class ForwardTo {
+template <typename Destination, typename Filter,
+          typename Profiler = NoProfiler>
+class ForwardTo {
   std::vector<input_event> m_event_buffer;
   Destination m_dest;
   Filter m_filter;
+  Profiler m_profiler;
 
 public:
   bool grab() { return true; }
 
-  ForwardTo(Destination dest, Filter filter)
-      : m_dest(std::move(dest)), m_filter(std::move(filter)) {
+  ForwardTo(Destination dest, Filter filter, Profiler profiler = Profiler())
+      : m_dest(std::move(dest)), m_filter(std::move(filter)),
+        m_profiler(std::move(profiler)) {
     m_event_buffer.reserve(50);
   }
 
+  Destination &destination() { return m_dest; }
+  Filter &filter() { return m_filter; }
+
   void eventSync(const input_event &) {}
 
   constexpr void eventReport(const input_event &ev) {
     m_event_buffer.push_back(ev);
+    m_profiler.beginFrame(m_event_buffer);
     m_filter.processEvents(m_event_buffer);
+    m_profiler.endFilter();
     for (auto &ev : m_event_buffer) {
       m_dest.writeEvent(ev);
     }
+    m_profiler.endWrite();
     m_event_buffer.clear();
   }
 
@@ -0,0 +1,298 @@
+/*
+ *
+ * This file is part of trackpad-is-too-damn-big utility
+ * Copyright (c) https://github.com/tascvh/trackpad-is-too-damn-big
+ *
+ */
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <format>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Protocol shared by both sides of a handoff over a unix socket :
+// the new process connects, the running one stops at a frame boundary and
+// sends a Message followed by the filter state, with the evdev and uinput
+// fds attached. The new process answers with a single byte once it owns
+// them, after which the old one exits without ungrabbing or destroying.
+namespace handoff {
+
+struct Message {
+  char magic[4];
+  uint32_t version;
+  uint32_t state_size;
+};
+constexpr char magic[4] = {'T', 'I', 'T', 'D'};
+constexpr uint32_t version = 1;
+constexpr uint8_t ack = 1;
+
+// how long either side waits for the other
+constexpr int timeout_sec = 5;
+
+inline sockaddr_un address(const std::string &path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw std::invalid_argument("Handoff socket path is too long: " + path);
+  }
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  return addr;
+}
+
+inline void setTimeout(int fd) {
+  timeval tv{};
+  tv.tv_sec = timeout_sec;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+} // namespace handoff
+
+// Listens for a newer process wanting to take over. Incoming connections
+// raise SIGIO, whose handler is expected to set handoff_requested and
+// stop the event loop. The socket is bound under a temporary name until
+// publish() moves it over the path, so the path keeps leading to the
+// running instance until this one has taken over.
+class HandoffServer final {
+  int m_fd = -1;
+  std::string m_path;
+  std::string m_bound_path;
+  bool m_published = false;
+
+public:
+  HandoffServer(const HandoffServer &) = delete;
+  HandoffServer &operator=(const HandoffServer &) = delete;
+  HandoffServer &operator=(HandoffServer &&) = delete;
+
+  HandoffServer(HandoffServer &&other) noexcept
+      : m_fd(other.m_fd), m_path(std::move(other.m_path)),
+        m_bound_path(std::move(other.m_bound_path)),
+        m_published(other.m_published) {
+    other.m_fd = -1;
+  }
+
+  HandoffServer(const std::string &path)
+      : m_path(path), m_bound_path(path + "." + std::to_string(getpid())) {
+    auto addr = handoff::address(m_bound_path);
+    m_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_fd < 0) {
+      throw std::runtime_error(std::format("Failed to create socket : {}",
+                                           std::strerror(errno)));
+    }
+    // left over by a crashed process with the same pid
+    unlink(m_bound_path.c_str());
+    if (bind(m_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        listen(m_fd, 1) != 0 || fcntl(m_fd, F_SETOWN, getpid()) != 0 ||
+        fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) | O_ASYNC) != 0) {
+      auto err = errno;
+      close(m_fd);
+      throw std::runtime_error(std::format("Failed to listen on {} : {}", path,
+                                           std::strerror(err)));
+    }
+  }
+
+  ~HandoffServer() {
+    if (m_fd < 0)
+      return;
+    close(m_fd);
+    if (!m_published) {
+      unlink(m_bound_path.c_str());
+    } else if (!handoff_requested) {
+      // otherwise the socket file belongs to whoever took over
+      unlink(m_path.c_str());
+    }
+  }
+
+  // Replaces whatever the path leads to, a stale file or the instance this
+  // one took over from. Failing only leaves this instance unreachable.
+  void publish() noexcept {
+    if (rename(m_bound_path.c_str(), m_path.c_str()) != 0) {
+      std::cerr << std::format("Failed to publish handoff socket {} : {}",
+                               m_path, std::strerror(errno))
+                << std::endl;
+      return;
+    }
+    m_published = true;
+  }
+
+  // Called once the event loop stopped for a handoff. Sends the device,
+  // the destination and the filter state, and returns true once the other
+  // process confirmed it owns them.
+  template <typename Handler> bool handOver(int evdev_fd, Handler &handler) {
+    int conn = accept4(m_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (conn < 0)
+      return false;
+    handoff::setTimeout(conn);
+
+    std::vector<int32_t> state;
+    handler.filter().saveState(state);
+
+    handoff::Message msg{};
+    std::memcpy(msg.magic, handoff::magic, sizeof(msg.magic));
+    msg.version = handoff::version;
+    msg.state_size = static_cast<uint32_t>(state.size());
+
+    std::array<int, 2> fds = {evdev_fd, handler.destination().fd()};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+    std::array<iovec, 2> iov = {
+        {{&msg, sizeof(msg)}, {state.data(), state.size() * sizeof(int32_t)}}};
+
+    msghdr mh{};
+    mh.msg_iov = iov.data();
+    mh.msg_iovlen = iov.size();
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    auto cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(fds));
+
+    auto size = sizeof(msg) + state.size() * sizeof(int32_t);
+    uint8_t reply = 0;
+    bool done =
+        sendmsg(conn, &mh, MSG_NOSIGNAL) == static_cast<ssize_t>(size) &&
+        recv(conn, &reply, 1, 0) == 1 && reply == handoff::ack;
+    close(conn);
+
+    if (done) {
+      handler.destination().release();
+      handler.filter().release();
+      std::cerr << "Handed over to the new instance" << std::endl;
+    } else {
+      std::cerr << "Handoff failed, resuming" << std::endl;
+    }
+    return done;
+  }
+};
+
+// Taking over from a running instance, on the side of the new process.
+class Takeover final {
+  int m_socket = -1;
+  int m_evdev_fd = -1;
+  int m_uinput_fd = -1;
+  std::vector<int32_t> m_state;
+
+  Takeover(int socket) : m_socket(socket) {}
+
+  void receive() {
+    handoff::Message msg{};
+    std::array<int, 2> fds;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+    iovec iov = {&msg, sizeof(msg)};
+
+    msghdr mh{};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    auto n = recvmsg(m_socket, &mh, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+
+    auto cmsg = CMSG_FIRSTHDR(&mh);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+      std::memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(fds));
+      m_evdev_fd = fds[0];
+      m_uinput_fd = fds[1];
+    }
+
+    if (n != sizeof(msg) || m_evdev_fd < 0 || m_uinput_fd < 0 ||
+        std::memcmp(msg.magic, handoff::magic, sizeof(msg.magic)) != 0 ||
+        msg.version != handoff::version) {
+      throw std::runtime_error("Invalid handoff from running instance");
+    }
+
+    m_state.resize(msg.state_size);
+    auto size = m_state.size() * sizeof(int32_t);
+    if (size > 0 && recv(m_socket, m_state.data(), size, MSG_WAITALL) !=
+                        static_cast<ssize_t>(size)) {
+      throw std::runtime_error("Truncated handoff from running instance");
+    }
+  }
+
+public:
+  Takeover(const Takeover &) = delete;
+  Takeover &operator=(const Takeover &) = delete;
+  Takeover &operator=(Takeover &&) = delete;
+
+  Takeover(Takeover &&other) noexcept
+      : m_socket(other.m_socket), m_evdev_fd(other.m_evdev_fd),
+        m_uinput_fd(other.m_uinput_fd), m_state(std::move(other.m_state)) {
+    other.m_socket = -1;
+    other.m_evdev_fd = -1;
+    other.m_uinput_fd = -1;
+  }
+
+  ~Takeover() {
+    for (int fd : {m_socket, m_evdev_fd, m_uinput_fd}) {
+      if (fd >= 0)
+        close(fd);
+    }
+  }
+
+  // Asks the instance listening on path to hand over, nullopt when there
+  // is none.
+  static std::optional<Takeover> request(const std::string &path) {
+    auto addr = handoff::address(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      throw std::runtime_error(std::format("Failed to create socket : {}",
+                                           std::strerror(errno)));
+    }
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+      close(fd);
+      return std::nullopt;
+    }
+    handoff::setTimeout(fd);
+
+    Takeover t(fd);
+    t.receive();
+    return t;
+  }
+
+  // Refuses a device other than the one this instance was started for, the
+  // running instance then gets no ack and resumes.
+  void checkDevice(const std::string &device) const {
+    struct stat wanted, handed;
+    if (stat(device.c_str(), &wanted) != 0) {
+      throw std::runtime_error(std::format("Failed to stat device ({}) : {}",
+                                           device, std::strerror(errno)));
+    }
+    if (fstat(m_evdev_fd, &handed) != 0 || handed.st_rdev != wanted.st_rdev) {
+      throw std::runtime_error(std::format(
+          "Running instance serves another device than {}", device));
+    }
+  }
+
+  // ownership of the fds passes to the caller
+  int evdevFd() { return std::exchange(m_evdev_fd, -1); }
+  int uinputFd() { return std::exchange(m_uinput_fd, -1); }
+
+  template <typename Filter> void restore(Filter &filter) {
+    filter.loadState(m_state);
+  }
+
+  // lets the old instance exit, call once everything is set up
+  void complete() {
+    if (m_socket < 0)
+      return;
+    if (send(m_socket, &handoff::ack, 1, MSG_NOSIGNAL) != 1) {
+      throw std::runtime_error("Failed to confirm handoff");
+    }
+    close(m_socket);
+    m_socket = -1;
+    std::cerr << "Took over from the running instance" << std::endl;
+  }
+};
@@ -0,0 +1,566 @@
+/*
+ *
+ * This file is part of trackpad-is-too-damn-big utility
+ * Copyright (c) https://github.com/tascvh/trackpad-is-too-damn-big
+ *
+ */
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <ctime>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <pthread.h>
+#include <random>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "clock.hpp"
+#include "libevdev/libevdev.h"
+
+extern "C" void print_evdev(struct libevdev *dev);
+
+// Description of a 10 finger trackpad, used as the synthetic input device.
+class FakeTrackpad final {
+  struct libevdev *m_dev = nullptr;
+
+public:
+  static constexpr int num_slots = 10;
+  static constexpr int width = 4000;
+  static constexpr int height = 2500;
+  static constexpr int resolution = 40;
+  static constexpr int size_max = 255;
+
+  FakeTrackpad(const FakeTrackpad &) = delete;
+  FakeTrackpad &operator=(const FakeTrackpad &) = delete;
+  FakeTrackpad &operator=(FakeTrackpad &&) = delete;
+
+  FakeTrackpad(FakeTrackpad &&other) noexcept : m_dev(other.m_dev) {
+    other.m_dev = nullptr;
+  }
+
+  FakeTrackpad() {
+    m_dev = libevdev_new();
+    if (!m_dev) {
+      throw std::runtime_error("Failed to init libevdev");
+    }
+    libevdev_set_name(m_dev, "titdb synthetic trackpad");
+    libevdev_set_id_bustype(m_dev, BUS_VIRTUAL);
+
+    libevdev_enable_property(m_dev, INPUT_PROP_POINTER);
+    libevdev_enable_property(m_dev, INPUT_PROP_BUTTONPAD);
+
+    libevdev_enable_event_type(m_dev, EV_KEY);
+    for (auto code : {BTN_LEFT, BTN_TOUCH, BTN_TOOL_FINGER, BTN_TOOL_DOUBLETAP,
+                      BTN_TOOL_TRIPLETAP, BTN_TOOL_QUADTAP,
+                      BTN_TOOL_QUINTTAP}) {
+      libevdev_enable_event_code(m_dev, EV_KEY, code, nullptr);
+    }
+
+    auto axis = [this](unsigned int code, int maximum, int res) {
+      input_absinfo ai{};
+      ai.maximum = maximum;
+      ai.resolution = res;
+      libevdev_enable_event_code(m_dev, EV_ABS, code, &ai);
+    };
+    libevdev_enable_event_type(m_dev, EV_ABS);
+    axis(ABS_X, width, resolution);
+    axis(ABS_Y, height, resolution);
+    axis(ABS_MT_SLOT, num_slots - 1, 0);
+    axis(ABS_MT_TRACKING_ID, 65535, 0);
+    axis(ABS_MT_POSITION_X, width, resolution);
+    axis(ABS_MT_POSITION_Y, height, resolution);
+    axis(ABS_MT_TOUCH_MAJOR, size_max, 0);
+    axis(ABS_MT_PRESSURE, size_max, 0);
+  }
+
+  ~FakeTrackpad() {
+    if (m_dev)
+      libevdev_free(m_dev);
+  }
+
+  template <typename T, typename... Args> T Spawn(Args... args) {
+    return T(m_dev, args...);
+  }
+
+  void print() { print_evdev(m_dev); }
+};
+
+// Produces the frames of a scripted or randomized touch scenario on the
+// FakeTrackpad geometry.
+class Scenario {
+public:
+  enum class Type { Fingers, Palms, Swipe, Random, Invalid };
+  static Type FromString(const std::string &type) {
+    if (type == "fingers")
+      return Type::Fingers;
+    if (type == "palms")
+      return Type::Palms;
+    if (type == "swipe")
+      return Type::Swipe;
+    if (type == "random")
+      return Type::Random;
+    return Type::Invalid;
+  }
+  static std::string Usage() {
+    return "generated scenario : fingers/palms/swipe/random";
+  }
+
+private:
+  static constexpr int W = FakeTrackpad::width;
+  static constexpr int H = FakeTrackpad::height;
+  static constexpr int N = FakeTrackpad::num_slots;
+
+  struct Touch {
+    int id = -1;
+    bool started = false;
+    bool lifted = false;
+    int x = 0;
+    int y = 0;
+    int size = 0;
+    int dx = 0;
+    int dy = 0;
+  };
+
+  Type m_type;
+  std::mt19937 m_rng{1};
+  std::array<Touch, N> m_touches;
+  int m_next_id = 0;
+  int m_reported_fingers = 0;
+  uint64_t m_frame = 0;
+
+  void down(int slot, int x, int y, int size, int dx = 0, int dy = 0) {
+    auto &t = m_touches[slot];
+    t.id = m_next_id++ & 0xffff;
+    t.started = true;
+    t.x = x;
+    t.y = y;
+    t.size = size;
+    t.dx = dx;
+    t.dy = dy;
+  }
+
+  void up(int slot) {
+    auto &t = m_touches[slot];
+    if (t.id == -1)
+      return;
+    t.id = -1;
+    t.lifted = true;
+  }
+
+  void move(Touch &t) {
+    t.x += t.dx;
+    t.y += t.dy;
+    if (t.x < 0 || t.x > W) {
+      t.dx = -t.dx;
+      t.x = std::clamp(t.x, 0, W);
+    }
+    if (t.y < 0 || t.y > H) {
+      t.dy = -t.dy;
+      t.y = std::clamp(t.y, 0, H);
+    }
+  }
+
+  int random(int lo, int hi) {
+    return std::uniform_int_distribution<int>(lo, hi)(m_rng);
+  }
+
+  void step() {
+    auto f = m_frame++;
+    switch (m_type) {
+    case Type::Fingers: {
+      // all ten fingers down, wiggling, then lifted
+      auto phase = f % 200;
+      for (int s = 0; s < N; ++s) {
+        if (phase == 0) {
+          down(s, W / 10 + (s % 5) * W / 5, H / 3 + (s / 5) * H / 3, 40,
+               random(-8, 8), random(-8, 8));
+        } else if (phase == 199) {
+          up(s);
+        } else {
+          move(m_touches[s]);
+        }
+      }
+      break;
+    }
+    case Type::Palms: {
+      // palms resting in the bottom corners, one finger moving in between
+      if (f % 1000 == 0) {
+        down(0, W * 8 / 100, H * 93 / 100, 220);
+        down(1, W * 92 / 100, H * 93 / 100, 210);
+      } else if (f % 1000 == 999) {
+        up(0);
+        up(1);
+      }
+      if (f % 100 == 0) {
+        down(2, W / 2, H / 2, 40, 11, 7);
+      } else if (f % 100 == 99) {
+        up(2);
+      } else {
+        move(m_touches[2]);
+      }
+      break;
+    }
+    case Type::Swipe: {
+      // three finger swipes across the pad
+      auto &lead = m_touches[0];
+      if (lead.id == -1) {
+        for (int s = 0; s < 3; ++s)
+          down(s, W / 10, H / 4 + s * H / 4, 45, W / 60, 0);
+      } else if (lead.x > W * 9 / 10) {
+        for (int s = 0; s < 3; ++s)
+          up(s);
+      } else {
+        for (int s = 0; s < 3; ++s)
+          move(m_touches[s]);
+      }
+      break;
+    }
+    case Type::Random: {
+      for (int s = 0; s < N; ++s) {
+        auto &t = m_touches[s];
+        if (t.id == -1) {
+          if (random(0, 49) == 0)
+            down(s, random(0, W), random(0, H), random(20, 230),
+                 random(-30, 30), random(-30, 30));
+        } else if (random(0, 99) == 0) {
+          up(s);
+        } else {
+          move(t);
+        }
+      }
+      break;
+    }
+    case Type::Invalid:
+      break;
+    }
+  }
+
+  static input_event event(unsigned int type, unsigned int code, int value) {
+    input_event ev{};
+    ev.type = type;
+    ev.code = code;
+    ev.value = value;
+    return ev;
+  }
+
+public:
+  Scenario(Type type) : m_type(type) {
+    if (type == Type::Invalid) {
+      throw std::invalid_argument("Invalid scenario");
+    }
+  }
+
+  // the next frame, terminated by SYN_REPORT
+  void nextFrame(std::vector<input_event> &frame) {
+    frame.clear();
+    step();
+
+    int fingers = 0;
+    const Touch *first = nullptr;
+    for (int s = 0; s < N; ++s) {
+      auto &t = m_touches[s];
+      if (t.lifted) {
+        frame.push_back(event(EV_ABS, ABS_MT_SLOT, s));
+        frame.push_back(event(EV_ABS, ABS_MT_TRACKING_ID, -1));
+        t.lifted = false;
+      }
+      if (t.id == -1)
+        continue;
+      if (!first)
+        first = &t;
+      fingers++;
+      frame.push_back(event(EV_ABS, ABS_MT_SLOT, s));
+      if (t.started) {
+        frame.push_back(event(EV_ABS, ABS_MT_TRACKING_ID, t.id));
+        t.started = false;
+      }
+      frame.push_back(event(EV_ABS, ABS_MT_POSITION_X, t.x));
+      frame.push_back(event(EV_ABS, ABS_MT_POSITION_Y, t.y));
+      frame.push_back(event(EV_ABS, ABS_MT_TOUCH_MAJOR, t.size));
+      frame.push_back(event(EV_ABS, ABS_MT_PRESSURE, t.size));
+    }
+
+    if (fingers != m_reported_fingers) {
+      static constexpr std::array<unsigned int, 5> tools = {
+          BTN_TOOL_FINGER, BTN_TOOL_DOUBLETAP, BTN_TOOL_TRIPLETAP,
+          BTN_TOOL_QUADTAP, BTN_TOOL_QUINTTAP};
+      auto tool = [](int n) { return std::min(n, 5) - 1; };
+      if (m_reported_fingers == 0 || fingers == 0)
+        frame.push_back(event(EV_KEY, BTN_TOUCH, fingers > 0));
+      if (m_reported_fingers > 0)
+        frame.push_back(event(EV_KEY, tools[tool(m_reported_fingers)], 0));
+      if (fingers > 0)
+        frame.push_back(event(EV_KEY, tools[tool(fingers)], 1));
+      m_reported_fingers = fingers;
+    }
+    if (first) {
+      frame.push_back(event(EV_ABS, ABS_X, first->x));
+      frame.push_back(event(EV_ABS, ABS_Y, first->y));
+    }
+    frame.push_back(event(EV_SYN, SYN_REPORT, 0));
+  }
+};
+
+// Sleeps until the next frame is due, a rate of 0 does not wait at all.
+class Pacer {
+  int64_t m_period_ns;
+  timespec m_next;
+  uint64_t m_late = 0;
+
+public:
+  Pacer(int rate) : m_period_ns(rate > 0 ? ns_per_sec / rate : 0) {
+    clock_gettime(CLOCK_MONOTONIC, &m_next);
+  }
+
+  void wait() {
+    if (m_period_ns == 0)
+      return;
+    auto now = clockNs(CLOCK_MONOTONIC);
+    auto next = toNs(m_next) + m_period_ns;
+    if (now > next + m_period_ns) {
+      // more than a frame behind, do not burst to catch up
+      m_late++;
+      next = now;
+    }
+    m_next.tv_sec = next / ns_per_sec;
+    m_next.tv_nsec = next % ns_per_sec;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &m_next, nullptr);
+  }
+
+  uint64_t late() const { return m_late; }
+};
+
+// Writes a scenario to the synthetic uinput device from its own thread.
+template <typename Destination> class Generator {
+  Destination m_dest;
+  Scenario m_scenario;
+  int m_rate;
+  std::atomic<uint64_t> m_frames = 0;
+  uint64_t m_late = 0;
+  std::thread m_thread;
+
+  void run() {
+    // signals are for the event loop thread
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+    std::vector<input_event> frame;
+    frame.reserve(100);
+    Pacer pacer(m_rate);
+    while (!stop_requested) {
+      m_scenario.nextFrame(frame);
+      for (const auto &ev : frame) {
+        m_dest.writeEvent(ev);
+      }
+      m_frames.fetch_add(1, std::memory_order_relaxed);
+      pacer.wait();
+    }
+    m_late = pacer.late();
+  }
+
+public:
+  Generator(const Generator &) = delete;
+  Generator &operator=(const Generator &) = delete;
+
+  Generator(Destination dest, Scenario scenario, int rate)
+      : m_dest(std::move(dest)), m_scenario(std::move(scenario)),
+        m_rate(rate) {}
+
+  ~Generator() {
+    if (!m_thread.joinable())
+      return;
+    requestStop();
+    m_thread.join();
+    std::cerr << std::format("Generated {} frames, {} behind schedule",
+                             m_frames.load(), m_late)
+              << std::endl;
+  }
+
+  std::string devnode() const { return m_dest.devnode(); }
+
+  void start() {
+    m_thread = std::thread([this] { run(); });
+  }
+};
+
+// In process replacement for Evdev, feeds a scenario straight to the
+// handler so the pipeline can be exercised without /dev/uinput.
+class SyntheticSource final {
+  FakeTrackpad m_pad;
+  Scenario m_scenario;
+  int m_rate;
+
+public:
+  SyntheticSource(Scenario scenario, int rate)
+      : m_scenario(std::move(scenario)), m_rate(rate) {}
+
+  template <typename T, typename... Args> T Spawn(Args... args) {
+    return m_pad.Spawn<T>(args...);
+  }
+
+  void print() { m_pad.print(); }
+
+  template <typename EventHandler> auto runEventLoop(EventHandler &&handler) {
+    std::vector<input_event> frame;
+    frame.reserve(100);
+    Pacer pacer(m_rate);
+    while (!stop_requested) {
+      m_scenario.nextFrame(frame);
+      timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      for (auto &ev : frame) {
+        ev.input_event_sec = now.tv_sec;
+        ev.input_event_usec = now.tv_nsec / 1000;
+        if (ev.type == EV_SYN) {
+          handler.eventReport(ev);
+        } else {
+          handler.eventData(ev);
+        }
+      }
+      pacer.wait();
+    }
+    return 0;
+  }
+};
+
+// Destination discarding everything, for the in process source.
+class NullSink {
+public:
+  constexpr int writeEvent(const input_event &) { return 0; }
+};
+
+// Wraps an event handler, reports throughput, input latency, SYN_DROPPED
+// and memory growth periodically and stops the loop after the duration.
+template <typename Handler> class Soak {
+  static constexpr int64_t report_interval_ns = 10'000'000'000;
+
+  struct Stats {
+    int64_t start_ns = 0;
+    int64_t interval_start_ns = 0;
+    uint64_t frames = 0;
+    uint64_t events = 0;
+    uint64_t syn_dropped = 0;
+    uint64_t interval_frames = 0;
+    uint64_t interval_events = 0;
+    int64_t interval_latency_us = 0;
+    int64_t interval_latency_max_us = 0;
+    int64_t latency_max_us = 0;
+    long rss_start_kb = 0;
+  };
+
+  Handler m_handler;
+  int64_t m_duration_ns;
+  bool m_owner = true;
+  Stats m_stats;
+
+  static long rssKb() {
+    std::ifstream statm("/proc/self/statm");
+    long size = 0, resident = 0;
+    statm >> size >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+  }
+
+  void report(int64_t now_ns) {
+    auto &s = m_stats;
+    double secs = double(now_ns - s.interval_start_ns) / double(ns_per_sec);
+    auto rss = rssKb();
+    std::cerr << std::format(
+                     "soak {:>6}s : {:>8.0f} frames/s {:>9.0f} events/s, "
+                     "latency avg {} us max {} us, syn_dropped {}, "
+                     "rss {} kB ({:+} kB)",
+                     (now_ns - s.start_ns) / ns_per_sec,
+                     secs > 0 ? s.interval_frames / secs : 0.0,
+                     secs > 0 ? s.interval_events / secs : 0.0,
+                     s.interval_frames ? s.interval_latency_us /
+                                             int64_t(s.interval_frames)
+                                       : 0,
+                     s.interval_latency_max_us, s.syn_dropped, rss,
+                     rss - s.rss_start_kb)
+              << std::endl;
+    s.interval_start_ns = now_ns;
+    s.interval_frames = 0;
+    s.interval_events = 0;
+    s.interval_latency_us = 0;
+    s.interval_latency_max_us = 0;
+  }
+
+public:
+  Soak(Soak &&other) noexcept
+      : m_handler(std::move(other.m_handler)),
+        m_duration_ns(other.m_duration_ns), m_owner(other.m_owner),
+        m_stats(other.m_stats) {
+    other.m_owner = false;
+  }
+
+  // duration in seconds, 0 runs until interrupted
+  Soak(Handler handler, int duration)
+      : m_handler(std::move(handler)),
+        m_duration_ns(int64_t(duration) * ns_per_sec) {
+    m_stats.start_ns = clockNs(CLOCK_MONOTONIC);
+    m_stats.interval_start_ns = m_stats.start_ns;
+    m_stats.rss_start_kb = rssKb();
+  }
+
+  ~Soak() {
+    if (!m_owner)
+      return;
+    auto &s = m_stats;
+    auto now_ns = clockNs(CLOCK_MONOTONIC);
+    double secs = double(now_ns - s.start_ns) / double(ns_per_sec);
+    auto rss = rssKb();
+    std::cerr << std::format(
+                     "Soak summary : {} frames, {} events in {:.1f}s "
+                     "({:.0f} frames/s), latency max {} us, syn_dropped {}, "
+                     "rss {} kB ({:+} kB)",
+                     s.frames, s.events, secs,
+                     secs > 0 ? s.frames / secs : 0.0, s.latency_max_us,
+                     s.syn_dropped, rss, rss - s.rss_start_kb)
+              << std::endl;
+  }
+
+  bool grab() { return m_handler.grab(); }
+
+  void eventSync(const input_event &ev) {
+    if (ev.type == EV_SYN && ev.code == SYN_DROPPED)
+      m_stats.syn_dropped++;
+    m_handler.eventSync(ev);
+  }
+
+  void eventData(const input_event &ev) {
+    m_stats.events++;
+    m_stats.interval_events++;
+    m_handler.eventData(ev);
+  }
+
+  void eventReport(const input_event &ev) {
+    auto &s = m_stats;
+    if (ev.code == SYN_DROPPED)
+      s.syn_dropped++;
+    s.events++;
+    s.frames++;
+    s.interval_events++;
+    s.interval_frames++;
+
+    // input time stamps are on the realtime clock
+    auto latency_us = (clockNs(CLOCK_REALTIME) / 1000) -
+                      (int64_t(ev.input_event_sec) * 1000000 +
+                       ev.input_event_usec);
+    s.interval_latency_us += latency_us;
+    s.interval_latency_max_us = std::max(s.interval_latency_max_us, latency_us);
+    s.latency_max_us = std::max(s.latency_max_us, latency_us);
+
+    m_handler.eventReport(ev);
+
+    auto now_ns = clockNs(CLOCK_MONOTONIC);
+    if (now_ns - s.interval_start_ns >= report_interval_ns)
+      report(now_ns);
+    if (m_duration_ns > 0 && now_ns - s.start_ns >= m_duration_ns)
+      requestStop();
+  }
+};
@@ -7,9 +7,39 @@
 #include "devices.hpp"
 #include "event_filters.hpp"
 #include "event_handlers.hpp"
+#include "handoff.hpp"
+#include "load_generator.hpp"
 #include "simple_parser.hpp"
+#include "zone_learner.hpp"
+#include <atomic>
+#include <csignal>
 #include <iostream>
 #include <optional>
+#include <type_traits>
+
+// Set by SIGINT/SIGTERM, unlike a handoff this stop is never cancelled.
+static std::atomic<bool> exit_requested = false;
+
+// Lets SIGINT/SIGTERM wake the event loop so it can ungrab the device and
+// the handlers can report before exiting. SIGIO comes
+// from the handoff socket and stops the loop without ungrabbing.
+static void installStopHandler() {
+  struct sigaction sa {};
+  sa.sa_handler = [](int) {
+    exit_requested = true;
+    requestStop();
+  };
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0; // no SA_RESTART
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
+  sa.sa_handler = [](int) {
+    handoff_requested = true;
+    requestStop();
+  };
+  sigaction(SIGIO, &sa, nullptr);
+}
 
 int main(int argc, char **argv) {
 
@@ -35,6 +65,14 @@ int main(int argc, char **argv) {
     int right(10);
     int top(0);
     int bottom(15);
+    bool profile(false);
+    std::optional<std::string> heatmap;
+    bool apply_learned(false);
+    std::optional<std::string> scenario;
+    int rate(1000);
+    std::optional<int> soak;
+    bool rootless(false);
+    std::optional<std::string> handoff_path;
 
     {
       SimpleParser sp(argc, argv);
@@ -46,46 +84,200 @@ int main(int argc, char **argv) {
       sp.read(right, "-r", "right percentage", {0, 100});
       sp.read(top, "-t", "top percentage", {0, 100});
       sp.read(bottom, "-b", "bottom percentage", {0, 100});
+      sp.read(profile, "--profile",
+              "print per stage performance counters on exit");
+      sp.read(heatmap, "--learn",
+              "touch heatmap filename, learns palm zones while running");
+      sp.read(apply_learned, "--apply-learned",
+              "crop the zones suggested by the heatmap instead of -l/-r/-t/-b");
+      sp.read(scenario, "--generate",
+              Scenario::Usage() + ", replaces -d with a synthetic trackpad");
+      sp.read(rate, "--rate", "generated frames per second, 0 for unpaced",
+              {0, 20000});
+      sp.read(soak, "--soak",
+              "report throughput periodically and stop after the given "
+              "seconds, 0 for never",
+              std::pair<std::optional<int>, std::optional<int>>(0, {}));
+      sp.read(rootless, "--rootless",
+              "feed the generated scenario in process, without uinput");
+      sp.read(handoff_path, "--handoff",
+              "unix socket to take over a running instance from, and to "
+              "hand over to the next one");
 
       if (sp.m_showHelp) {
         std::cout << std::endl << "Example usage :" << std::endl;
         std::cout << "\t" << sp.programName() << " -d /dev/input/event0 -m f"
                   << std::endl;
+        std::cout << "\t" << sp.programName()
+                  << " --generate random --rate 4000 --soak 3600" << std::endl;
         return EXIT_SUCCESS;
       }
     }
 
-    if (!device)
+    if (!device && !scenario)
       throw std::invalid_argument("device argument is mandatory");
 
+    auto scenario_type = Scenario::FromString(scenario.value_or(""));
+    if (scenario && scenario_type == Scenario::Type::Invalid)
+      throw std::invalid_argument("Invalid scenario: " + *scenario);
+
+    if (rootless && !scenario)
+      throw std::invalid_argument("--rootless requires --generate");
+
     auto running_mode = RunningMode::FromString(mode);
     if (running_mode == RunningMode::Type::Invalid)
       throw std::invalid_argument("Invalid running mode: " + mode);
 
+    if (apply_learned && !heatmap)
+      throw std::invalid_argument("--apply-learned requires --learn");
+
+    if (handoff_path &&
+        (scenario || soak || running_mode == RunningMode::Type::Print))
+      throw std::invalid_argument(
+          "--handoff only applies to forwarding a device in mode s/f");
+
     // All parameters are valid
 
-    auto evdev = Evdev(*device);
+    installStopHandler();
 
-    switch (running_mode) {
-    case RunningMode::Type::Print: {
-      evdev.print();
-      return evdev.runEventLoop(PrintEvents());
-    }
-    case RunningMode::Type::Strict: {
-      return evdev.runEventLoop(
-          ForwardTo(evdev.Spawn<UInput>(),
-                    evdev.Spawn<CropRect>(left, right, top, bottom)));
-    }
-    case RunningMode::Type::Flex: {
-      return evdev.runEventLoop(
-          ForwardTo(evdev.Spawn<UInput>(),
-                    evdev.Spawn<CropRectFlex>(left, right, top, bottom)));
-    }
-    case RunningMode::Type::Invalid: {
-      // unreachable
+    std::optional<Takeover> takeover;
+    std::optional<HandoffServer> server;
+
+    // runs the selected mode reading from source, ready is called once
+    // everything is set up and the loop is about to start
+    auto serve = [&](auto &source, auto make_dest, auto ready) {
+      std::optional<ZoneLearner> learner;
+      if (heatmap) {
+        learner.emplace(source.template Spawn<ZoneLearner>(*heatmap));
+        if (apply_learned) {
+          if (auto m = learner->suggest()) {
+            left = m->left;
+            right = m->right;
+            top = m->top;
+            bottom = m->bottom;
+            std::cerr << std::format("Applying learned crop : -l {} -r {} "
+                                     "-t {} -b {}",
+                                     left, right, top, bottom)
+                      << std::endl;
+          } else {
+            std::cerr << "Not enough samples in heatmap, using -l/-r/-t/-b"
+                      << std::endl;
+          }
+        }
+      }
+
+      auto run = [&](auto handler) {
+        ready();
+        if (soak)
+          return source.runEventLoop(Soak(std::move(handler), *soak));
+        return source.runEventLoop(std::move(handler));
+      };
+
+      // like run, but hands the device over when a new instance asks to,
+      // only a real device can be handed over
+      auto run_forward = [&](auto handler) {
+        using Source = std::remove_cvref_t<decltype(source)>;
+        if constexpr (std::is_same_v<Source, Evdev>) {
+          if (handoff_path) {
+            ready();
+            while (true) {
+              auto rc = source.runEventLoop(handler);
+              if (!handoff_requested ||
+                  server->handOver(source.fd(), handler))
+                return rc;
+              // nobody took over, keep going unless interrupted meanwhile
+              handoff_requested = false;
+              stop_requested = false;
+              if (exit_requested)
+                requestStop();
+            }
+          }
+        }
+        return run(std::move(handler));
+      };
+
+      auto forward_to = [&](auto filter) {
+        if (profile) {
+          return run_forward(
+              ForwardTo(make_dest(), std::move(filter), StageProfiler()));
+        }
+        return run_forward(ForwardTo(make_dest(), std::move(filter)));
+      };
+
+      auto forward = [&](auto filter) {
+        if (takeover)
+          takeover->restore(filter);
+        if (learner)
+          return forward_to(LearnZones(std::move(filter), std::move(*learner)));
+        return forward_to(std::move(filter));
+      };
+
+      switch (running_mode) {
+      case RunningMode::Type::Print: {
+        source.print();
+        return run(PrintEvents());
+      }
+      case RunningMode::Type::Strict: {
+        return forward(
+            source.template Spawn<CropRect>(left, right, top, bottom));
+      }
+      case RunningMode::Type::Flex: {
+        return forward(
+            source.template Spawn<CropRectFlex>(left, right, top, bottom));
+      }
+      case RunningMode::Type::Invalid: {
+        // unreachable
+      }
+      }
+      return EXIT_FAILURE;
+    };
+
+    if (!scenario) {
+      if (handoff_path) {
+        if (auto t = Takeover::request(*handoff_path)) {
+          t->checkDevice(*device);
+          takeover.emplace(std::move(*t));
+        }
+      }
+
+      // a running instance hands over its grabbed device and virtual
+      // device, so there is nothing to set up and no gap in between
+      auto evdev = takeover ? Evdev(takeover->evdevFd()) : Evdev(*device);
+      return serve(
+          evdev,
+          [&] {
+            return takeover ? UInput(takeover->uinputFd())
+                            : evdev.Spawn<UInput>();
+          },
+          [&] {
+            // the old instance exits on the ack, nothing may fail after it,
+            // and its socket is only replaced once it did
+            if (handoff_path)
+              server.emplace(*handoff_path);
+            if (takeover)
+              takeover->complete();
+            if (server)
+              server->publish();
+          });
     }
+
+    if (rootless) {
+      auto source = SyntheticSource(Scenario(scenario_type), rate);
+      return serve(source, [] { return NullSink(); }, [] {});
     }
 
+    auto pad = FakeTrackpad();
+    Generator<UInput> generator(pad.Spawn<UInput>(), Scenario(scenario_type),
+                                rate);
+    auto evdev = Evdev(generator.devnode());
+    // grab before the first frame so none of them reaches the desktop
+    return serve(
+        evdev, [&evdev] { return evdev.Spawn<UInput>(); },
+        [&evdev, &generator] {
+          evdev.grab(true);
+          generator.start();
+        });
+
   } catch (const std::invalid_argument &e) {
     std::cerr << "invalid argument: " << e.what() << std::endl;
     std::cerr << "use -h for help" << std::endl;
@@ -0,0 +1,356 @@
+/*
+ *
+ * This file is part of trackpad-is-too-damn-big utility
+ * Copyright (c) https://github.com/tascvh/trackpad-is-too-damn-big
+ *
+ */
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <format>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "clock.hpp"
+#include "libevdev/libevdev.h"
+
+class NoProfiler {
+public:
+  constexpr void beginFrame(const std::vector<input_event> &) noexcept {}
+  constexpr void endFilter() noexcept {}
+  constexpr void endWrite() noexcept {}
+};
+
+// Samples hardware counters around the filter and write stages of every
+// frame and aggregates them per stage and per number of active contacts.
+// Falls back to wall / thread cpu clocks when perf events are not available.
+class StageProfiler final {
+public:
+  enum Counter { Instructions, Cycles, CacheMisses, BranchMisses, NumCounters };
+  enum Stage { Filter, Write, NumStages };
+
+  // frames with more contacts are accounted in the last bucket
+  static constexpr int max_contacts = 10;
+  // empty stages timed at startup to measure the cost of sampling itself
+  static constexpr int calibration_rounds = 1000;
+
+private:
+  struct Sample {
+    uint64_t wall_ns = 0;
+    uint64_t cpu_ns = 0;
+    std::array<uint64_t, NumCounters> counters{};
+  };
+
+  struct Totals {
+    uint64_t frames = 0;
+    uint64_t wall_ns = 0;
+    uint64_t wall_ns_max = 0;
+    uint64_t cpu_ns = 0;
+    std::array<uint64_t, NumCounters> counters{};
+  };
+
+  static constexpr std::array<const char *, NumCounters> counter_names = {
+      "instr", "cycles", "cache-miss", "branch-miss"};
+  static constexpr std::array<const char *, NumStages> stage_names = {
+      "filter", "write"};
+
+  std::array<int, NumCounters> m_fds;
+  // position of each counter in the group read, -1 if unavailable
+  std::array<int, NumCounters> m_read_index;
+  int m_num_open = 0;
+  bool m_user_only = false;
+  bool m_owner = true;
+  // from the last group read, running < enabled when the group was
+  // multiplexed with other perf users
+  uint64_t m_time_enabled = 0;
+  uint64_t m_time_running = 0;
+
+  int m_current_slot = 0;
+  uint64_t m_active_slots = 0;
+
+  Sample m_begin;
+  Sample m_filtered;
+  // average cost of an empty stage, subtracted from every measured one
+  Sample m_overhead;
+  std::array<std::array<Totals, max_contacts + 1>, NumStages> m_totals{};
+
+  static int openCounter(uint64_t config, int group_fd, bool user_only) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group_fd == -1 ? 1 : 0;
+    attr.exclude_kernel = user_only ? 1 : 0;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return static_cast<int>(
+        syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0));
+  }
+
+  // returns the errno of the first counter failing to open, 0 if none
+  int openCounters(bool user_only) {
+    static constexpr std::array<uint64_t, NumCounters> configs = {
+        PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+    int err = 0;
+    for (int c = 0; c < NumCounters; ++c) {
+      int fd = openCounter(configs[c], leader(), user_only);
+      if (fd < 0) {
+        if (err == 0)
+          err = errno;
+        continue;
+      }
+      m_fds[c] = fd;
+      m_read_index[c] = m_num_open++;
+    }
+    return err;
+  }
+
+  void closeCounters() {
+    for (auto &fd : m_fds) {
+      if (fd >= 0)
+        close(fd);
+      fd = -1;
+    }
+    m_read_index.fill(-1);
+    m_num_open = 0;
+  }
+
+  int leader() const {
+    for (int fd : m_fds) {
+      if (fd >= 0)
+        return fd;
+    }
+    return -1;
+  }
+
+  void sample(Sample &s) noexcept {
+    if (m_num_open > 0) {
+      // nr, time enabled, time running, then one value per counter
+      std::array<uint64_t, NumCounters + 3> buf;
+      if (read(leader(), buf.data(), sizeof(buf)) > 0) {
+        m_time_enabled = buf[1];
+        m_time_running = buf[2];
+        for (int c = 0; c < NumCounters; ++c) {
+          if (m_read_index[c] >= 0)
+            s.counters[c] = buf[3 + m_read_index[c]];
+        }
+      }
+    } else {
+      s.cpu_ns = static_cast<uint64_t>(clockNs(CLOCK_THREAD_CPUTIME_ID));
+    }
+    s.wall_ns = static_cast<uint64_t>(clockNs(CLOCK_MONOTONIC));
+  }
+
+  static uint64_t delta(uint64_t from, uint64_t to,
+                        uint64_t overhead) noexcept {
+    auto d = to - from;
+    return d > overhead ? d - overhead : 0;
+  }
+
+  void account(Stage stage, const Sample &from, const Sample &to) noexcept {
+    auto contacts = std::min(std::popcount(m_active_slots), max_contacts);
+    auto &t = m_totals[stage][contacts];
+    auto wall_ns = delta(from.wall_ns, to.wall_ns, m_overhead.wall_ns);
+    t.frames++;
+    t.wall_ns += wall_ns;
+    t.wall_ns_max = std::max(t.wall_ns_max, wall_ns);
+    t.cpu_ns += delta(from.cpu_ns, to.cpu_ns, m_overhead.cpu_ns);
+    for (int c = 0; c < NumCounters; ++c) {
+      t.counters[c] +=
+          delta(from.counters[c], to.counters[c], m_overhead.counters[c]);
+    }
+  }
+
+  void calibrate() noexcept {
+    Sample from, to, total;
+    for (int i = 0; i < calibration_rounds; ++i) {
+      sample(from);
+      sample(to);
+      total.wall_ns += to.wall_ns - from.wall_ns;
+      total.cpu_ns += to.cpu_ns - from.cpu_ns;
+      for (int c = 0; c < NumCounters; ++c) {
+        total.counters[c] += to.counters[c] - from.counters[c];
+      }
+    }
+    m_overhead.wall_ns = total.wall_ns / calibration_rounds;
+    m_overhead.cpu_ns = total.cpu_ns / calibration_rounds;
+    for (int c = 0; c < NumCounters; ++c) {
+      m_overhead.counters[c] = total.counters[c] / calibration_rounds;
+    }
+  }
+
+  void printSummary() const {
+    auto &o = std::cerr;
+    o << std::endl << "Profile summary (";
+    if (m_num_open > 0) {
+      o << (m_user_only ? "hardware counters, user space only"
+                        : "hardware counters");
+    } else {
+      o << "hardware counters unavailable, software clocks";
+    }
+    o << "), averages per frame:" << std::endl;
+
+    o << std::format("  sampling overhead subtracted: {} wall ns",
+                     m_overhead.wall_ns);
+    if (m_num_open > 0) {
+      for (int c = 0; c < NumCounters; ++c) {
+        if (m_read_index[c] >= 0)
+          o << std::format(", {} {}", m_overhead.counters[c], counter_names[c]);
+      }
+    } else {
+      o << std::format(", {} cpu ns", m_overhead.cpu_ns);
+    }
+    o << std::endl;
+    if (m_num_open > 0 && m_time_running < m_time_enabled) {
+      o << std::format("  warning : counters ran {:.0f}% of the time, shared "
+                       "with other perf users",
+                       100.0 * static_cast<double>(m_time_running) /
+                           static_cast<double>(m_time_enabled))
+        << std::endl;
+    }
+
+    for (int s = 0; s < NumStages; ++s) {
+      o << std::format("  stage {}", stage_names[s]) << std::endl;
+      o << std::format("    {:>8} {:>10} {:>10} {:>10}", "contacts", "frames",
+                       "wall ns", "max ns");
+      if (m_num_open > 0) {
+        for (int c = 0; c < NumCounters; ++c) {
+          if (m_read_index[c] >= 0)
+            o << std::format(" {:>11}", counter_names[c]);
+        }
+        if (m_read_index[Instructions] >= 0 && m_read_index[Cycles] >= 0)
+          o << std::format(" {:>5}", "ipc");
+      } else {
+        o << std::format(" {:>10}", "cpu ns");
+      }
+      o << std::endl;
+
+      for (int n = 0; n <= max_contacts; ++n) {
+        const auto &t = m_totals[s][n];
+        if (t.frames == 0)
+          continue;
+        auto avg = [&t](uint64_t v) {
+          return static_cast<double>(v) / static_cast<double>(t.frames);
+        };
+        auto label = std::format("{}{}", n, n == max_contacts ? "+" : "");
+        o << std::format("    {:>8} {:>10} {:>10.0f} {:>10}", label, t.frames,
+                         avg(t.wall_ns), t.wall_ns_max);
+        if (m_num_open > 0) {
+          for (int c = 0; c < NumCounters; ++c) {
+            if (m_read_index[c] >= 0)
+              o << std::format(" {:>11.1f}", avg(t.counters[c]));
+          }
+          if (m_read_index[Instructions] >= 0 && m_read_index[Cycles] >= 0 &&
+              t.counters[Cycles] > 0) {
+            o << std::format(" {:>5.2f}",
+                             static_cast<double>(t.counters[Instructions]) /
+                                 static_cast<double>(t.counters[Cycles]));
+          }
+        } else {
+          o << std::format(" {:>10.0f}", avg(t.cpu_ns));
+        }
+        o << std::endl;
+      }
+    }
+  }
+
+public:
+  StageProfiler(const StageProfiler &) = delete;
+  StageProfiler &operator=(const StageProfiler &) = delete;
+  StageProfiler &operator=(StageProfiler &&) = delete;
+
+  StageProfiler(StageProfiler &&other) noexcept
+      : m_fds(other.m_fds), m_read_index(other.m_read_index),
+        m_num_open(other.m_num_open), m_user_only(other.m_user_only),
+        m_owner(other.m_owner), m_time_enabled(other.m_time_enabled),
+        m_time_running(other.m_time_running),
+        m_current_slot(other.m_current_slot),
+        m_active_slots(other.m_active_slots), m_overhead(other.m_overhead),
+        m_totals(other.m_totals) {
+    other.m_fds.fill(-1);
+    other.m_num_open = 0;
+    other.m_owner = false;
+  }
+
+  // counts the calling thread, construct it on the event loop thread
+  StageProfiler() {
+    m_fds.fill(-1);
+    m_read_index.fill(-1);
+
+    int err = openCounters(false);
+    if (m_num_open == 0 && (err == EACCES || err == EPERM)) {
+      // perf_event_paranoid may still allow user space only counting
+      m_user_only = true;
+      openCounters(true);
+    }
+
+    int fd = leader();
+    if (fd >= 0 &&
+        (ioctl(fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP) != 0 ||
+         ioctl(fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) != 0)) {
+      closeCounters();
+    }
+
+    calibrate();
+    if (m_num_open > 0 && m_time_running == 0) {
+      // opened fine but never scheduled, e.g. every counter is taken
+      std::cerr << "Hardware counters are not counting" << std::endl;
+      closeCounters();
+      calibrate();
+    }
+
+    if (m_num_open == 0) {
+      std::cerr << "Hardware counters unavailable, profiling with software "
+                   "clocks"
+                << std::endl;
+    }
+  }
+
+  ~StageProfiler() {
+    if (m_owner)
+      printSummary();
+    closeCounters();
+  }
+
+  void beginFrame(const std::vector<input_event> &event_buffer) noexcept {
+    // track the active contacts, the frame is accounted by their count
+    for (const auto &ev : event_buffer) {
+      switch (ev.code) {
+      case ABS_MT_SLOT:
+        m_current_slot = ev.value;
+        break;
+      case ABS_MT_TRACKING_ID:
+        if (m_current_slot < 0 || m_current_slot >= 64)
+          break;
+        if (ev.value == -1) {
+          m_active_slots &= ~(1ull << m_current_slot);
+        } else {
+          m_active_slots |= 1ull << m_current_slot;
+        }
+        break;
+      }
+    }
+    sample(m_begin);
+  }
+
+  void endFilter() noexcept {
+    sample(m_filtered);
+    account(Filter, m_begin, m_filtered);
+  }
+
+  void endWrite() noexcept {
+    Sample written;
+    sample(written);
+    account(Write, m_filtered, written);
+  }
+};
@@ -0,0 +1,386 @@
+/*
+ *
+ * This file is part of trackpad-is-too-damn-big utility
+ * Copyright (c) https://github.com/tascvh/trackpad-is-too-damn-big
+ *
+ */
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "libevdev/libevdev.h"
+
+// Learns where contacts begin and which of them turn out to be palms, on a
+// coarse grid over the device area, and suggests crop percentages from it.
+class ZoneLearner final {
+public:
+  // one cell is 5% of the device width / height
+  static constexpr int grid = 20;
+
+  struct Margins {
+    int left = 0;
+    int right = 0;
+    int top = 0;
+    int bottom = 0;
+  };
+
+private:
+  struct Header {
+    char magic[4];
+    uint16_t version;
+    uint16_t grid;
+    int32_t min_x;
+    int32_t max_x;
+    int32_t min_y;
+    int32_t max_y;
+  };
+  static constexpr char file_magic[4] = {'T', 'I', 'T', 'H'};
+  static constexpr uint16_t file_version = 1;
+
+  // a strip needs this many contacts before it is judged
+  static constexpr uint32_t min_samples = 20;
+  // a strip is cropped when at least this percentage of its contacts are palms
+  static constexpr uint32_t palm_ratio_perc = 50;
+
+  struct Contact {
+    bool active = false;
+    bool pending_start = false;
+    bool suppressed = false;
+    int x = 0;
+    int y = 0;
+    int start_x = 0;
+    int start_y = 0;
+    int major = 0;
+    int max_major = 0;
+    int64_t max_disp_sq = 0;
+  };
+
+  std::string m_filename;
+  bool m_owner = true;
+
+  int m_min_x;
+  int m_max_x;
+  int m_min_y;
+  int m_max_y;
+  int m_size_code;
+  int m_large_size;
+  int64_t m_stationary_sq;
+
+  int m_current_slot = 0;
+  std::vector<Contact> m_contacts;
+
+  std::array<uint32_t, grid * grid> m_starts{};
+  std::array<uint32_t, grid * grid> m_palms{};
+
+  constexpr int cell(int x, int y) const noexcept {
+    auto cx =
+        static_cast<int64_t>(x - m_min_x) * grid / (m_max_x - m_min_x + 1);
+    auto cy =
+        static_cast<int64_t>(y - m_min_y) * grid / (m_max_y - m_min_y + 1);
+    cx = std::clamp<int64_t>(cx, 0, grid - 1);
+    cy = std::clamp<int64_t>(cy, 0, grid - 1);
+    return static_cast<int>(cy * grid + cx);
+  }
+
+  constexpr Contact *current() noexcept {
+    if (m_current_slot < 0 ||
+        m_current_slot >= static_cast<int>(m_contacts.size()))
+      return nullptr;
+    return &m_contacts[m_current_slot];
+  }
+
+  void endContact(const Contact &c) noexcept {
+    bool palm = c.max_major >= m_large_size &&
+                c.max_disp_sq <= m_stationary_sq && c.suppressed;
+    if (palm)
+      m_palms[cell(c.start_x, c.start_y)]++;
+  }
+
+  void load() {
+    std::ifstream in(m_filename, std::ios::binary);
+    if (!in)
+      return;
+
+    Header h;
+    in.read(reinterpret_cast<char *>(&h), sizeof(h));
+    if (!in || std::memcmp(h.magic, file_magic, sizeof(file_magic)) != 0 ||
+        h.version != file_version || h.grid != grid) {
+      std::cerr << "Ignoring unreadable heatmap " << m_filename << std::endl;
+      return;
+    }
+    if (h.min_x != m_min_x || h.max_x != m_max_x || h.min_y != m_min_y ||
+        h.max_y != m_max_y) {
+      std::cerr << "Ignoring heatmap " << m_filename
+                << " recorded on a different device" << std::endl;
+      return;
+    }
+
+    decltype(m_starts) starts;
+    decltype(m_palms) palms;
+    in.read(reinterpret_cast<char *>(starts.data()), sizeof(starts));
+    in.read(reinterpret_cast<char *>(palms.data()), sizeof(palms));
+    if (!in) {
+      std::cerr << "Ignoring truncated heatmap " << m_filename << std::endl;
+      return;
+    }
+    m_starts = starts;
+    m_palms = palms;
+  }
+
+  // contacts and palms starting in the given rectangle of cells
+  std::pair<uint32_t, uint32_t> count(int x0, int x1, int y0,
+                                      int y1) const noexcept {
+    uint32_t starts = 0;
+    uint32_t palms = 0;
+    for (int cy = y0; cy <= y1; ++cy) {
+      for (int cx = x0; cx <= x1; ++cx) {
+        starts += m_starts[cy * grid + cx];
+        palms += m_palms[cy * grid + cx];
+      }
+    }
+    return {starts, palms};
+  }
+
+public:
+  ZoneLearner(const ZoneLearner &) = delete;
+  ZoneLearner &operator=(const ZoneLearner &) = delete;
+  ZoneLearner &operator=(ZoneLearner &&) = delete;
+
+  ZoneLearner(ZoneLearner &&other) noexcept
+      : m_filename(std::move(other.m_filename)), m_owner(other.m_owner),
+        m_min_x(other.m_min_x), m_max_x(other.m_max_x),
+        m_min_y(other.m_min_y), m_max_y(other.m_max_y),
+        m_size_code(other.m_size_code), m_large_size(other.m_large_size),
+        m_stationary_sq(other.m_stationary_sq),
+        m_current_slot(other.m_current_slot),
+        m_contacts(std::move(other.m_contacts)), m_starts(other.m_starts),
+        m_palms(other.m_palms) {
+    other.m_owner = false;
+  }
+
+  ZoneLearner(libevdev const *const dev, const std::string &filename)
+      : m_filename(filename) {
+    const input_absinfo *ai;
+
+    ai = libevdev_get_abs_info(dev, ABS_MT_SLOT);
+    if (!ai) {
+      throw std::runtime_error("Failed to get slot info");
+    }
+    m_contacts.resize(ai->maximum + 1);
+
+    ai = libevdev_get_abs_info(dev, ABS_X);
+    if (!ai) {
+      throw std::runtime_error("Failed to get abs x info");
+    }
+    m_min_x = ai->minimum;
+    m_max_x = ai->maximum;
+
+    ai = libevdev_get_abs_info(dev, ABS_Y);
+    if (!ai) {
+      throw std::runtime_error("Failed to get abs y info");
+    }
+    m_min_y = ai->minimum;
+    m_max_y = ai->maximum;
+
+    // contact size, not every trackpad reports the touch ellipse
+    m_size_code = libevdev_has_event_code(dev, EV_ABS, ABS_MT_TOUCH_MAJOR)
+                      ? ABS_MT_TOUCH_MAJOR
+                      : ABS_MT_PRESSURE;
+    ai = libevdev_get_abs_info(dev, m_size_code);
+    m_large_size = ai ? ai->minimum + (ai->maximum - ai->minimum) / 3 : 0;
+
+    // moved less than 1/20 of the diagonal
+    int64_t delta_x = m_max_x - m_min_x;
+    int64_t delta_y = m_max_y - m_min_y;
+    m_stationary_sq = (delta_x * delta_x + delta_y * delta_y) / 400;
+
+    load();
+  }
+
+  ~ZoneLearner() {
+    if (!m_owner)
+      return;
+    save();
+    if (auto m = suggest()) {
+      std::cerr << std::format("Suggested crop : -l {} -r {} -t {} -b {}",
+                               m->left, m->right, m->top, m->bottom)
+                << std::endl;
+    }
+  }
+
+  // the heatmap was saved for the instance that took over and is theirs now
+  void release() noexcept { m_owner = false; }
+
+  void save() const {
+    std::ofstream out(m_filename, std::ios::binary | std::ios::trunc);
+    Header h{};
+    std::memcpy(h.magic, file_magic, sizeof(file_magic));
+    h.version = file_version;
+    h.grid = grid;
+    h.min_x = m_min_x;
+    h.max_x = m_max_x;
+    h.min_y = m_min_y;
+    h.max_y = m_max_y;
+    out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+    out.write(reinterpret_cast<const char *>(m_starts.data()),
+              sizeof(m_starts));
+    out.write(reinterpret_cast<const char *>(m_palms.data()), sizeof(m_palms));
+    if (!out) {
+      std::cerr << "Failed to save heatmap " << m_filename << std::endl;
+    }
+  }
+
+  // Shrinks the valid area one edge strip at a time, always dropping the
+  // palm dominated strip that removes the most palms for its area, until
+  // none is left. Strips without enough samples do not stop the search.
+  std::optional<Margins> suggest() const {
+    int x0 = 0, x1 = grid - 1, y0 = 0, y1 = grid - 1;
+    if (count(x0, x1, y0, y1).first < min_samples)
+      return std::nullopt;
+
+    std::array<int *, 4> edges = {&x0, &x1, &y0, &y1};
+    static constexpr std::array<int, 4> steps = {1, -1, 1, -1};
+    static constexpr std::array<bool, 4> columns = {true, true, false, false};
+
+    while (true) {
+      int best = -1;
+      int best_depth = 0;
+      uint64_t best_cells = 1;
+      uint64_t best_palms = 0;
+      for (int e = 0; e < 4; ++e) {
+        // strips too sparse to judge are peeled along with the palm
+        // dominated strip behind them
+        uint64_t peeled_palms = 0;
+        for (int depth = 0;; ++depth) {
+          // keep at least half of the device in each direction
+          int size = (columns[e] ? x1 - x0 : y1 - y0) + 1 - depth;
+          if (size <= grid / 2)
+            break;
+          int pos = *edges[e] + steps[e] * depth;
+          auto [starts, palms] =
+              columns[e] ? count(pos, pos, y0, y1) : count(x0, x1, pos, pos);
+          peeled_palms += palms;
+          if (starts < min_samples)
+            continue;
+          // prefer the edge removing the most palms for the area given up
+          uint64_t cells =
+              (depth + 1) * (columns[e] ? y1 - y0 + 1 : x1 - x0 + 1);
+          if (uint64_t(palms) * 100 >= uint64_t(starts) * palm_ratio_perc &&
+              peeled_palms * best_cells > best_palms * cells) {
+            best = e;
+            best_depth = depth + 1;
+            best_cells = cells;
+            best_palms = peeled_palms;
+          }
+          break;
+        }
+      }
+      if (best < 0)
+        break;
+      *edges[best] += steps[best] * best_depth;
+    }
+
+    // device y grows downwards, the top margin starts at the minimum
+    Margins m;
+    m.left = x0 * 100 / grid;
+    m.right = (grid - 1 - x1) * 100 / grid;
+    m.top = y0 * 100 / grid;
+    m.bottom = (grid - 1 - y1) * 100 / grid;
+    return m;
+  }
+
+  // before the filter, the raw state of the contacts
+  void observeRaw(const std::vector<input_event> &event_buffer) noexcept {
+    for (const auto &ev : event_buffer) {
+      if (ev.code == ABS_MT_SLOT) {
+        m_current_slot = ev.value;
+        continue;
+      }
+      auto c = current();
+      if (!c)
+        continue;
+
+      switch (ev.code) {
+      case ABS_MT_TRACKING_ID:
+        if (c->active)
+          endContact(*c);
+        // values equal to the previous contact of the slot are not resent
+        *c = Contact{.x = c->x, .y = c->y, .major = c->major};
+        if (ev.value != -1) {
+          c->active = true;
+          c->pending_start = true;
+        }
+        break;
+      case ABS_MT_POSITION_X:
+        c->x = ev.value;
+        break;
+      case ABS_MT_POSITION_Y:
+        c->y = ev.value;
+        break;
+      }
+      if (ev.code == m_size_code)
+        c->major = ev.value;
+    }
+
+    for (auto &c : m_contacts) {
+      if (!c.active)
+        continue;
+      if (c.pending_start) {
+        c.pending_start = false;
+        c.start_x = c.x;
+        c.start_y = c.y;
+        m_starts[cell(c.x, c.y)]++;
+      }
+      int64_t dx = c.x - c.start_x;
+      int64_t dy = c.y - c.start_y;
+      c.max_disp_sq = std::max(c.max_disp_sq, dx * dx + dy * dy);
+      c.max_major = std::max(c.max_major, c.major);
+    }
+  }
+
+  // after the filter, a contact is suppressed when the filter discarded its
+  // slot, whether or not its size was resent in this frame
+  template <typename Filter> void observeFiltered(const Filter &filter) {
+    for (size_t s = 0; s < m_contacts.size(); ++s) {
+      auto &c = m_contacts[s];
+      if (c.active && filter.suppressed(static_cast<int>(s)))
+        c.suppressed = true;
+    }
+  }
+};
+
+template <typename Filter> class LearnZones {
+  Filter m_filter;
+  ZoneLearner m_learner;
+
+public:
+  LearnZones(Filter filter, ZoneLearner learner)
+      : m_filter(std::move(filter)), m_learner(std::move(learner)) {}
+
+  // the state is only saved for a handoff, the new instance loads the
+  // heatmap once it received the state
+  void saveState(std::vector<int32_t> &state) const {
+    m_filter.saveState(state);
+    m_learner.save();
+  }
+  void loadState(const std::vector<int32_t> &state) {
+    m_filter.loadState(state);
+  }
+  void release() noexcept {
+    m_filter.release();
+    m_learner.release();
+  }
+
+  void processEvents(std::vector<input_event> &event_buffer) noexcept {
+    m_learner.observeRaw(event_buffer);
+    m_filter.processEvents(event_buffer);
+    m_learner.observeFiltered(m_filter);
+  }
+};